@@ -3,28 +3,46 @@
 //            Trabalho II: Sistema de Gestão de Ficheiros             //
 //                                                                    //
 // Compilação: gcc vfs.c -Wall -lreadline -o vfs                      //
-// Utilização: ./vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] FILESYSTEM //
+// Utilização: ./vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] [-c]       //
+//                    FILESYSTEM                                      //
 //                                                                    //
 ////////////////////////////////////////////////////////////////////////
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fnmatch.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #define MAXARGS 100
-#define CHECK_NUMBER 9999
+#define CHECK_NUMBER 9997
 #define TYPE_DIR 'D'
 #define TYPE_FILE 'F'
 #define MAX_NAME_LENGHT 20
+#define PACK_MAGIC 0x4B415056
+
+// buracos (blocos só com zeros que não são guardados) num ficheiro: um elo da cadeia
+// (first_block ou fat[]) menor que -1 indica N blocos a zero seguidos do bloco NEXT
+#define HOLE_BLOCK -2
+#define HOLE_MAX ((1 << 20) - 2)  // maior N que cabe num elo
+#define HOLE_LINK(N, NEXT) (-2 - ((N) << 11 | ((NEXT) + 1)))
+#define IS_HOLE_LINK(L) ((L) < -1)
+#define HOLE_COUNT(L) ((-2 - (L)) >> 11)
+#define HOLE_NEXT(L) (((-2 - (L)) & 2047) - 1)
 
 #define FAT_ENTRIES(TYPE) ((TYPE) == 7 ? 128 : (TYPE) == 8 ? 256 : (TYPE) == 9 ? 512 : 1024)
 #define FAT_SIZE(TYPE) (FAT_ENTRIES(TYPE) * sizeof(int))
@@ -54,13 +72,29 @@ typedef struct directory_entry {
   unsigned char year;          // ano em que foi criada (entre 0 e 255 - 0 representa o ano de 1900)
   int size;                    // tamanho em bytes (0 se TYPE_DIR)
   int first_block;             // primeiro bloco de dados
+  unsigned int crc;            // CRC32C do conteúdo (0 se TYPE_DIR)
 } dir_entry;
 
+typedef struct pack_header {
+  int magic;       // número que identifica um pacote (PACK_MAGIC)
+  int block_size;  // tamanho de um bloco do sistema de ficheiros de origem
+  int fat_type;    // tipo de FAT do sistema de ficheiros de origem
+  int n_blocks;    // número de blocos em uso (guardados no pacote)
+} pack_header;
+
+typedef struct chain_cursor {
+  int next;   // próximo bloco da cadeia (-1 no fim)
+  int holes;  // número de buracos antes de next
+} chain_cursor;
+
 // variáveis globais
 superblock *sb;   // superblock do sistema de ficheiros
 int *fat;         // apontador para a FAT
 char *blocks;     // apontador para a região dos dados
 int current_dir;  // bloco do diretório corrente
+dev_t fs_dev;     // dispositivo e i-node do sistema de ficheiros montado
+ino_t fs_ino;
+int check_crc;    // verificar o CRC32C dos ficheiros em cat e put (opção -c)
 
 // funções auxiliares
 COMMAND parse(char *);
@@ -72,6 +106,7 @@ void init_fat(void);
 void init_dir_block(int, int);
 void init_dir_entry(dir_entry *, char, char *, int, int);
 void exec_com(COMMAND);
+unsigned int crc32c(unsigned int, const void *, size_t);
 
 // funções de manipulação de diretórios
 void vfs_ls(void);
@@ -88,6 +123,19 @@ void vfs_cp(char *, char *);
 void vfs_mv(char *, char *);
 void vfs_rm(char *);
 
+// funções de verificação do sistema de ficheiros
+int vfs_fsck(int, int);
+void vfs_verify(void);
+
+// funções de pesquisa na árvore de diretórios
+void vfs_find(char *);
+void vfs_du(void);
+void vfs_tree(void);
+
+// funções de exportação compacta do sistema de ficheiros
+void vfs_pack(char *);
+void vfs_unpack(char *, char *);
+
 
 int main(int argc, char *argv[]) {
   char *linha;
@@ -126,7 +174,7 @@ void parse_argv(int argc, char *argv[]) {
   // valores por omissão
   block_size = 256;
   fat_type = 8;
-  if (argc < 2 || argc > 4) {
+  if (argc < 2 || argc > 5) {
     printf("vfs: invalid number of arguments\n");
     show_usage_and_exit();
   }
@@ -144,6 +192,8 @@ void parse_argv(int argc, char *argv[]) {
     printf("vfs: invalid fat type (%d)\n", fat_type);
     show_usage_and_exit();
   }
+      } else if (argv[i][1] == 'c' && argv[i][2] == '\0') {
+  check_crc = 1;
       } else {
   printf("vfs: invalid argument (%s)\n", argv[i]);
   show_usage_and_exit();
@@ -159,7 +209,7 @@ void parse_argv(int argc, char *argv[]) {
 
 
 void show_usage_and_exit(void) {
-  printf("Usage: vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] FILESYSTEM\n");
+  printf("Usage: vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] [-c] FILESYSTEM\n");
   exit(1);
 }
 
@@ -221,7 +271,15 @@ void init_filesystem(int block_size, int fat_type, char *filesystem_name) {
       printf("vfs: invalid filesystem (%s)\n", filesystem_name);
       show_usage_and_exit();
     }
+
+    // verifica a estrutura do sistema de ficheiros (sem a alterar)
+    if (vfs_fsck(0, 0) > 0)
+      printf("vfs: filesystem has errors - run 'fsck' to repair\n");
   }
+  struct stat fs_stat;
+  fstat(fsd, &fs_stat);
+  fs_dev = fs_stat.st_dev;
+  fs_ino = fs_stat.st_ino;
   close(fsd);
 
   // inicia o diretório corrente
@@ -272,6 +330,7 @@ void init_dir_entry(dir_entry *dir, char type, char *name, int size, int first_b
   dir->year = cur_tm->tm_year;
   dir->size = size;
   dir->first_block = first_block;
+  dir->crc = 0;
   return;
 }
 
@@ -353,6 +412,47 @@ void exec_com(COMMAND com) {
       printf("ERROR(input: 'rm' - too many arguments)\n");
     else
       vfs_rm(com.argv[1]);
+  } else if (!strcmp(com.cmd, "fsck")) {
+    if (com.argc > 1)
+      printf("ERROR(input: 'fsck' - too many arguments)\n");
+    else
+      vfs_fsck(1, 1);
+  } else if (!strcmp(com.cmd, "verify")) {
+    if (com.argc > 1)
+      printf("ERROR(input: 'verify' - too many arguments)\n");
+    else
+      vfs_verify();
+  } else if (!strcmp(com.cmd, "find")) {
+    if (com.argc < 2)
+      printf("ERROR(input: 'find' - too few arguments)\n");
+    else if (com.argc > 2)
+      printf("ERROR(input: 'find' - too many arguments)\n");
+    else
+      vfs_find(com.argv[1]);
+  } else if (!strcmp(com.cmd, "du")) {
+    if (com.argc > 1)
+      printf("ERROR(input: 'du' - too many arguments)\n");
+    else
+      vfs_du();
+  } else if (!strcmp(com.cmd, "tree")) {
+    if (com.argc > 1)
+      printf("ERROR(input: 'tree' - too many arguments)\n");
+    else
+      vfs_tree();
+  } else if (!strcmp(com.cmd, "pack")) {
+    if (com.argc < 2)
+      printf("ERROR(input: 'pack' - too few arguments)\n");
+    else if (com.argc > 2)
+      printf("ERROR(input: 'pack' - too many arguments)\n");
+    else
+      vfs_pack(com.argv[1]);
+  } else if (!strcmp(com.cmd, "unpack")) {
+    if (com.argc < 3)
+      printf("ERROR(input: 'unpack' - too few arguments)\n");
+    else if (com.argc > 3)
+      printf("ERROR(input: 'unpack' - too many arguments)\n");
+    else
+      vfs_unpack(com.argv[1], com.argv[2]);
   } else
     printf("ERROR(input: command not found)\n");
   return;
@@ -378,6 +478,198 @@ void put_free_block(int block){
   return;
 }
 
+// bloco só com zeros (do tamanho máximo de um bloco), usado para os buracos dos ficheiros
+static char zero_block[1024];
+
+// testa se os n bytes de buf são todos zero (o memcmp da libc usa instruções vectoriais)
+int is_zero_block(char *buf, int n){
+  return buf[0] == 0 && memcmp(buf, zero_block, n) == 0;
+}
+
+// percorre a cadeia de um ficheiro a partir do elo link
+void chain_start(chain_cursor *c, int link){
+  if(IS_HOLE_LINK(link)){
+    c->holes = HOLE_COUNT(link);
+    c->next = HOLE_NEXT(link);
+  } else {
+    c->holes = 0;
+    c->next = link;
+  }
+  return;
+}
+
+// devolve o bloco seguinte da cadeia, HOLE_BLOCK se for um buraco ou -1 no fim
+// (um elo para fora do sistema de ficheiros também termina a cadeia)
+int chain_step(chain_cursor *c){
+  int block = c->next;
+
+  if(c->holes > 0){
+    c->holes --;
+    return HOLE_BLOCK;
+  }
+  if(block < 0 || block >= FAT_ENTRIES(sb->fat_type))
+    return -1;
+  chain_start(c, fat[block]);
+  return block;
+}
+
+// devolve o bloco seguinte da cadeia, ignorando os buracos, ou -1 no fim
+int chain_next_data(chain_cursor *c){
+  c->holes = 0;
+  return chain_step(c);
+}
+
+// CRC32C (Castagnoli): instrução crc32 do SSE4.2 quando disponível, senão slicing-by-8
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void){
+  uint32_t i, j, crc;
+
+  for(i = 0; i < 256; i++){
+    crc = i;
+    for(j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    crc32c_table[0][i] = crc;
+  }
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^ crc32c_table[0][crc32c_table[j-1][i] & 0xFF];
+  return;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len){
+  uint64_t w;
+
+  while(len >= 8){
+    memcpy(&w, p, 8);
+    w ^= crc;
+    crc = crc32c_table[7][w & 0xFF] ^ crc32c_table[6][(w >> 8) & 0xFF] ^
+          crc32c_table[5][(w >> 16) & 0xFF] ^ crc32c_table[4][(w >> 24) & 0xFF] ^
+          crc32c_table[3][(w >> 32) & 0xFF] ^ crc32c_table[2][(w >> 40) & 0xFF] ^
+          crc32c_table[1][(w >> 48) & 0xFF] ^ crc32c_table[0][w >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while(len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len){
+  uint64_t w, c = crc;
+
+  while(len >= 8){
+    memcpy(&w, p, 8);
+    c = __builtin_ia32_crc32di(c, w);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t) c;
+  while(len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+// crc é o valor devolvido pela chamada anterior (0 no início)
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len){
+  static int mode = -1;  // -1: por decidir, 0: slicing-by-8, 1: SSE4.2
+
+  if(mode == -1){
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    mode = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    mode = 0;
+#endif
+    if(mode == 0) crc32c_init_table();
+  }
+#if defined(__x86_64__) && defined(__GNUC__)
+  if(mode == 1)
+    return ~crc32c_hw(~crc, buf, len);
+#endif
+  return ~crc32c_sw(~crc, buf, len);
+}
+
+// testa se o conteúdo do ficheiro descrito pela entrada e está intacto: a cadeia
+// tem de cobrir todo o ficheiro e o CRC32C tem de ser igual ao guardado na entrada
+int file_crc_ok(dir_entry *e){
+  chain_cursor c;
+  int block;
+  int size = e->size;
+  unsigned int crc = 0;
+
+  chain_start(&c, e->first_block);
+  while(size > 0 && (block = chain_step(&c)) != -1){
+    crc = crc32c(crc, block == HOLE_BLOCK ? zero_block : BLOCK(block), size < sb->block_size ? size : sb->block_size);
+    size -= sb->block_size;
+  }
+  return size <= 0 && crc == e->crc;
+}
+
+// devolve o número de blocos da cadeia que começa em block
+// (uma cadeia com ciclos é cortada ao fim de FAT_ENTRIES blocos)
+int chain_length(int block){
+  chain_cursor c;
+  int n = FAT_ENTRIES(sb->fat_type);
+  int len = 0;
+
+  chain_start(&c, block);
+  while(len < n && chain_next_data(&c) != -1)
+    len ++;
+  return len;
+}
+
+// liberta os blocos da cadeia que começa em block
+void free_chain(int block){
+  chain_cursor c;
+  int b;
+
+  chain_start(&c, block);
+  while((b = chain_next_data(&c)) != -1)
+    put_free_block(b);
+  return;
+}
+
+// escrita com buffer: as listagens longas são enviadas para o ecrã em blocos
+static char out_buf[8192];
+static int out_len;
+
+void out_flush(void){
+  fflush(stdout);
+  write(STDOUT_FILENO, out_buf, out_len);
+  out_len = 0;
+  return;
+}
+
+void out_printf(const char *fmt, ...){
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(out_buf + out_len, sizeof(out_buf) - out_len, fmt, ap);
+  va_end(ap);
+  if(out_len + n >= sizeof(out_buf)){
+    out_flush();
+    va_start(ap, fmt);
+    n = vsnprintf(out_buf, sizeof(out_buf), fmt, ap);
+    va_end(ap);
+    if(n >= sizeof(out_buf)) n = sizeof(out_buf) - 1;
+  }
+  out_len += n;
+  return;
+}
+
+// devolve a entrada i do diretório que começa no bloco block
+dir_entry *get_dir_entry(int block, int i){
+  int j;
+  for(j = i/DIR_ENTRIES_PER_BLOCK; j > 0; j--)
+    block = fat[block];
+  return (dir_entry *) BLOCK(block) + i%DIR_ENTRIES_PER_BLOCK;
+}
+
 ////////////////////////////////
 
 
@@ -641,46 +933,84 @@ void vfs_get(char *nome_orig, char *nome_dest) {
     return;
   }
   
-  int f_size = my_stat.st_size;
-  int req_size = (my_stat.st_size + sb->block_size - 1)/sb->block_size;
-  int require_blocks =  (k == DIR_ENTRIES_PER_BLOCK-1) + req_size;
-  
-  if(require_blocks > sb->n_free_blocks){
-    printf("ERROR(get: disk is full)\n");
+  if(my_stat.st_size > INT_MAX){
+    printf("ERROR(get: file %s is too big)\n",nome_orig);
     return;
   }
   
-  dir_o[0].size ++;
-  
-  int temp;
-  if(k == DIR_ENTRIES_PER_BLOCK-1){
-    temp = get_free_block();
-    fat[mdir] = temp;
-    mdir = temp;
+  int f = open(nome_orig, O_RDONLY);
+  if(f == -1){
+    printf("ERROR(get: couldnt found file %s)\n",nome_orig);
+    return;
   }
   
-  k = n_entry % DIR_ENTRIES_PER_BLOCK;
-  dir = (dir_entry *) BLOCK(mdir);
-  
-  int f_b = get_free_block();
-  int prev = f_b;
-  
-  init_dir_entry(&dir[k],TYPE_FILE,nome_dest,f_size,f_b);
-  
-  int f = open(nome_orig, O_RDONLY);
+  int f_size = my_stat.st_size;
+  int first = -1, *link = &first;
+  int holes = 0, full = 0;
+  unsigned int crc = 0;
   char msg[5000];
+  off_t pos, data = 0, hole_at = 0;
   
-  int n;
-  n = read(f,msg,sb->block_size);
-  while (n>0){
-    strcpy(BLOCK(f_b), msg);
-    n = read(f,msg,sb->block_size);
-    if(n>0){
-      prev = f_b;
-      f_b = get_free_block();
-      fat[prev] = f_b;
+  // os blocos só com zeros não são guardados: ficam como buracos na cadeia
+  int n, f_b;
+  for(pos = 0; pos < f_size; pos += sb->block_size){
+    n = f_size - pos < sb->block_size ? f_size - pos : sb->block_size;
+    // as zonas sem dados do ficheiro UNIX (SEEK_DATA/SEEK_HOLE) nem chegam a ser lidas
+    if(pos >= hole_at){
+      if((data = lseek(f, pos, SEEK_DATA)) == -1)
+        data = errno == ENXIO ? f_size : pos;
+      if((hole_at = lseek(f, data, SEEK_HOLE)) == -1)
+        hole_at = f_size;
     }
+    char *src = msg;
+    if(pos + n <= data)
+      src = zero_block;
+    else if(pread(f, msg, n, pos) != n){
+      close(f);
+      free_chain(first);
+      printf("ERROR(get: cannot read file %s)\n",nome_orig);
+      return;
+    }
+    crc = crc32c(crc, src, n);
+    // quando a sequência de buracos já não cabe num elo, o bloco a zeros é guardado
+    if((src == zero_block || is_zero_block(msg, n)) && holes < HOLE_MAX){
+      holes ++;
+      continue;
+    }
+    if((f_b = get_free_block()) == -1){
+      full = 1;
+      break;
+    }
+    memcpy(BLOCK(f_b), src, n);
+    *link = holes > 0 ? HOLE_LINK(holes, f_b) : f_b;
+    link = &fat[f_b];
+    holes = 0;
   }
+  if(holes > 0)
+    *link = HOLE_LINK(holes, -1);
+  close(f);
+  
+  if(!full && n_entry%DIR_ENTRIES_PER_BLOCK == 0){
+    int temp = get_free_block();
+    if(temp == -1)
+      full = 1;
+    else {
+      fat[mdir] = temp;
+      mdir = temp;
+    }
+  }
+  
+  if(full){
+    free_chain(first);
+    printf("ERROR(get: disk is full)\n");
+    return;
+  }
+  
+  k = n_entry % DIR_ENTRIES_PER_BLOCK;
+  dir = (dir_entry *) BLOCK(mdir);
+  init_dir_entry(&dir[k],TYPE_FILE,nome_dest,f_size,first);
+  dir[k].crc = crc;
+  dir_o[0].size ++;
   
   return;
 }
@@ -688,6 +1018,58 @@ void vfs_get(char *nome_orig, char *nome_dest) {
 
 // put fich1 fich2 - copia um ficheiro do nosso sistema fich1 para um ficheiro normal UNIX fich2
 void vfs_put(char *nome_orig, char *nome_dest) {
+  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
+  int n_entry = dir[0].size;
+  int mdir = current_dir;
+  
+  int i,k;
+  for(i = 0;i<n_entry;i++){
+    k = i%DIR_ENTRIES_PER_BLOCK;
+    if(k == 0 && i != 0){
+      mdir = fat[mdir];
+      dir = (dir_entry *) BLOCK(mdir);
+    }
+    if(strcmp(nome_orig,dir[k].name) == 0) break;
+  }
+  
+  if(i == n_entry){
+    printf("ERROR(put: no file with name '%s')\n",nome_orig);
+    return;
+  }
+  
+  if(dir[k].type != TYPE_FILE){
+    printf("ERROR(put: '%s' is not a file)\n",nome_orig);
+    return;
+  }
+  
+  if(check_crc && !file_crc_ok(&dir[k])){
+    printf("ERROR(put: '%s' is corrupted - checksum mismatch)\n",nome_orig);
+    return;
+  }
+  
+  int f = open(nome_dest, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(f == -1){
+    printf("ERROR(put: cannot create file %s)\n",nome_dest);
+    return;
+  }
+  
+  // os buracos do ficheiro são recriados como buracos no ficheiro UNIX
+  chain_cursor c;
+  int block;
+  int size = dir[k].size;
+  chain_start(&c, dir[k].first_block);
+  while(size>0 && (block = chain_step(&c)) != -1){
+    if(block == HOLE_BLOCK)
+      lseek(f, size < sb->block_size ? size : sb->block_size, SEEK_CUR);
+    else if(size < sb->block_size)
+      write(f, BLOCK(block), size);
+    else
+      write(f, BLOCK(block), sb->block_size);
+    size -= sb->block_size;
+  }
+  ftruncate(f, dir[k].size);
+  close(f);
+  
   return;
 }
 
@@ -718,15 +1100,22 @@ void vfs_cat(char *nome_fich) {
     return;
   }
   
-  int block = dir[k].first_block;
+  if(check_crc && !file_crc_ok(&dir[k])){
+    printf("ERROR(cat: '%s' is corrupted - checksum mismatch)\n",nome_fich);
+    return;
+  }
+  
+  chain_cursor c;
+  int block;
   int size = dir[k].size;
-  while(size>0){
+  chain_start(&c, dir[k].first_block);
+  while(size>0 && (block = chain_step(&c)) != -1){
+    char *data = block == HOLE_BLOCK ? zero_block : BLOCK(block);
     if(size < sb->block_size)
-      write(STDOUT_FILENO, BLOCK(block), size);
+      write(STDOUT_FILENO, data, size);
     else
-      write(STDOUT_FILENO, BLOCK(block), sb->block_size);
+      write(STDOUT_FILENO, data, sb->block_size);
     size -= sb->block_size;
-    block = fat[block]; 
   }
   
   return;
@@ -751,3 +1140,647 @@ void vfs_mv(char *nome_orig, char *nome_dest) {
 void vfs_rm(char *nome_fich) {
   return;
 }
+
+
+// fsck - verifica a consistência do sistema de ficheiros e, se repair != 0, repara-o
+static int fsck_errors;
+static int fsck_verbose;
+
+void fsck_report(const char *fmt, ...){
+  va_list ap;
+
+  fsck_errors ++;
+  if(!fsck_verbose) return;
+  va_start(ap, fmt);
+  printf("fsck: ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+  return;
+}
+
+// marca os blocos da cadeia que começa em first (já marcado) e devolve o seu comprimento;
+// a cadeia é cortada no 1º elo inválido, no 1º bloco já usado ou após max blocos
+int fsck_chain(int first, int max, char *mark, int repair, char *name){
+  int n = FAT_ENTRIES(sb->fat_type);
+  int block = first, len = 1, next;
+
+  while((next = fat[block]) != -1){
+    if(len == max){
+      fsck_report("'%.*s' - chain longer than needed (%d blocks)", MAX_NAME_LENGHT, name, max);
+      if(repair){
+        fat[block] = -1;
+        break;
+      }
+    }
+    if(next < 0 || next >= n){
+      fsck_report("'%.*s' - invalid block %d in chain", MAX_NAME_LENGHT, name, next);
+      if(repair) fat[block] = -1;
+      break;
+    }
+    if(mark[next]){
+      fsck_report("'%.*s' - block %d is cross-linked", MAX_NAME_LENGHT, name, next);
+      if(repair) fat[block] = -1;
+      break;
+    }
+    mark[next] = 1;
+    block = next;
+    len ++;
+  }
+  return len;
+}
+
+// verifica a cadeia (com buracos) do ficheiro da entrada e e marca os seus blocos
+void fsck_file(dir_entry *e, char *mark, int repair){
+  int n = FAT_ENTRIES(sb->fat_type);
+  int need = (e->size + sb->block_size - 1)/sb->block_size;
+  int *link = &e->first_block;
+  int len = 0, long_chain = 0;  // len: blocos já percorridos, incluindo buracos
+  int holes, block;
+
+  while(*link != -1){
+    holes = IS_HOLE_LINK(*link) ? HOLE_COUNT(*link) : 0;
+    block = IS_HOLE_LINK(*link) ? HOLE_NEXT(*link) : *link;
+    if(!long_chain && len + holes + (block != -1) > need){
+      fsck_report("'%.*s' - chain longer than needed (%d blocks)", MAX_NAME_LENGHT, e->name, need);
+      long_chain = 1;
+      if(repair){
+        holes = need - len < HOLE_MAX ? need - len : HOLE_MAX;
+        *link = holes > 0 ? HOLE_LINK(holes, -1) : -1;
+        len += holes;
+        break;
+      }
+    }
+    if(block != -1 && (block < 0 || block >= n || mark[block])){
+      if(block < 0 || block >= n)
+        fsck_report("'%.*s' - invalid block %d in chain", MAX_NAME_LENGHT, e->name, block);
+      else
+        fsck_report("'%.*s' - block %d is cross-linked", MAX_NAME_LENGHT, e->name, block);
+      if(repair) *link = holes > 0 ? HOLE_LINK(holes, -1) : -1;
+      len += holes;
+      break;
+    }
+    len += holes;
+    if(block == -1) break;
+    mark[block] = 1;
+    len ++;
+    link = &fat[block];
+  }
+
+  if(len < need){
+    fsck_report("'%.*s' - size larger than its chain (%d bytes)", MAX_NAME_LENGHT, e->name, e->size);
+    if(repair) e->size = len*sb->block_size;
+  }
+  return;
+}
+
+// verifica o diretório que começa em block; os subdiretórios são empilhados em stack
+void fsck_dir(int block, int parent, char *mark, int *stack, int *top, int repair){
+  char name[MAX_NAME_LENGHT+1];
+  int n = FAT_ENTRIES(sb->fat_type);
+  int epb = DIR_ENTRIES_PER_BLOCK;
+  dir_entry *dir = (dir_entry *) BLOCK(block);
+  int n_entry = dir[0].size;
+  snprintf(name, sizeof(name), "dir@%d", block);
+  int valid = n_entry >= 2 && n_entry <= n*epb;
+  int len = fsck_chain(block, valid ? (n_entry + epb - 1)/epb : n, mark, repair, name);
+
+  if(!valid || n_entry > len*epb){
+    fsck_report("'%.*s' - invalid number of entries (%d)", MAX_NAME_LENGHT, name, n_entry);
+    n_entry = n_entry < 2 ? 2 : len*epb;
+    if(repair) dir[0].size = n_entry;
+  }
+  if(dir[0].type != TYPE_DIR || dir[0].first_block != block){
+    fsck_report("'%.*s' - invalid '.' entry", MAX_NAME_LENGHT, name);
+    if(repair) init_dir_entry(&dir[0], TYPE_DIR, ".", n_entry, block);
+  }
+  if(dir[1].type != TYPE_DIR || dir[1].first_block != parent){
+    fsck_report("'%.*s' - invalid '..' entry", MAX_NAME_LENGHT, name);
+    if(repair) init_dir_entry(&dir[1], TYPE_DIR, "..", 0, parent);
+  }
+
+  int i = 2;
+  while(i < n_entry){
+    dir_entry *e = get_dir_entry(block, i);
+    char *err = NULL;
+    if(e->type != TYPE_DIR && e->type != TYPE_FILE)
+      err = "invalid entry type";
+    else if(e->type == TYPE_DIR && (e->first_block < 0 || e->first_block >= n))
+      err = "invalid first block";
+    else if(e->type == TYPE_DIR && mark[e->first_block])
+      err = "first block is cross-linked";
+    else if(e->type == TYPE_FILE && e->size < 0)
+      err = "invalid size";
+
+    if(err != NULL){
+      fsck_report("'%.*s' - %s", MAX_NAME_LENGHT, e->name, err);
+      if(repair){
+        // remove a entrada, substituindo-a pela última do diretório
+        *e = *get_dir_entry(block, n_entry - 1);
+        dir[0].size = -- n_entry;
+      } else
+        i ++;
+      continue;
+    }
+
+    if(e->type == TYPE_DIR){
+      mark[e->first_block] = 1;
+      stack[(*top)++] = e->first_block;
+      stack[(*top)++] = block;
+    } else
+      fsck_file(e, mark, repair);
+    i ++;
+  }
+
+  // liberta os blocos do diretório que deixaram de ser necessários
+  if(repair){
+    int last = block;
+    for(i = (n_entry + epb - 1)/epb; i > 1; i--)
+      last = fat[last];
+    int extra = fat[last];
+    fat[last] = -1;
+    for(; extra != -1; extra = fat[extra])
+      mark[extra] = 0;
+  }
+  return;
+}
+
+// devolve o número de erros encontrados
+int vfs_fsck(int repair, int verbose){
+  int n = FAT_ENTRIES(sb->fat_type);
+  int i, block, count, bad, lost;
+
+  fsck_errors = 0;
+  fsck_verbose = verbose;
+  if(sb->root_block < 0 || sb->root_block >= n){
+    fsck_report("invalid root block (%d) - cannot check", sb->root_block);
+    return fsck_errors;
+  }
+
+  // 0: não visto, 1: em uso, 2: na lista de blocos livres
+  char *mark = calloc(n, sizeof(char));
+  int *stack = malloc(2*n*sizeof(int));
+  int top = 0, cwd_found = 0;
+
+  // percorre a árvore de diretórios a partir da raiz
+  mark[sb->root_block] = 1;
+  stack[top++] = sb->root_block;
+  stack[top++] = sb->root_block;
+  while(top > 0){
+    int parent = stack[--top];
+    block = stack[--top];
+    if(block == current_dir) cwd_found = 1;
+    fsck_dir(block, parent, mark, stack, &top, repair);
+  }
+
+  // verifica a lista de blocos livres
+  bad = 0;
+  count = 0;
+  block = sb->free_block;
+  while(block != -1){
+    if(block < 0 || block >= n){
+      fsck_report("free list - invalid block %d", block);
+      bad = 1;
+      break;
+    }
+    if(mark[block] == 1){
+      fsck_report("free list - block %d is in use", block);
+      bad = 1;
+      break;
+    }
+    if(mark[block] == 2){
+      fsck_report("free list - loop at block %d", block);
+      bad = 1;
+      break;
+    }
+    mark[block] = 2;
+    count ++;
+    block = fat[block];
+  }
+
+  lost = 0;
+  for(i = 0; i < n; i++)
+    if(mark[i] == 0) lost ++;
+  if(!bad && lost > 0){
+    fsck_report("free list - %d lost block(s)", lost);
+    bad = 1;
+  }
+  if(!bad && count != sb->n_free_blocks){
+    fsck_report("free list - wrong number of free blocks (%d, should be %d)", sb->n_free_blocks, count);
+    bad = 1;
+  }
+
+  // reconstrói a lista de blocos livres com todos os blocos não usados
+  if(repair && bad){
+    sb->free_block = -1;
+    sb->n_free_blocks = 0;
+    for(i = n - 1; i >= 0; i--)
+      if(mark[i] != 1)
+        put_free_block(i);
+  }
+
+  if(repair && !cwd_found)
+    current_dir = sb->root_block;
+
+  if(verbose){
+    if(fsck_errors == 0)
+      printf("fsck: filesystem is clean\n");
+    else
+      printf("fsck: %d error(s) found%s\n", fsck_errors, repair ? " and repaired" : "");
+  }
+
+  free(mark);
+  free(stack);
+  return fsck_errors;
+}
+
+
+// percorre (em profundidade) a árvore de diretórios a partir do diretório block;
+// pre é chamada para cada entrada e devolve 0 se não se deve descer nesse subdiretório,
+// post (se não for NULL) é chamada para cada subdiretório depois de percorrido
+typedef int (*walk_fn)(dir_entry *, char *, int, int, void *);
+
+void walk_dir(int block, char *path, int len, int depth, char *seen, walk_fn pre, walk_fn post, void *arg){
+  int n = FAT_ENTRIES(sb->fat_type);
+  dir_entry *dir = (dir_entry *) BLOCK(block);
+  int n_entry = dir[0].size;
+  int mdir = block;
+  
+  int i,k;
+  for(i = 2;i<n_entry;i++){
+    k = i%DIR_ENTRIES_PER_BLOCK;
+    if(k == 0){
+      // a cadeia do diretório termina num elo inválido ou num bloco já visitado
+      mdir = fat[mdir];
+      if(mdir < 0 || mdir >= n || seen[mdir])
+        break;
+      seen[mdir] = 1;
+      dir = (dir_entry *) BLOCK(mdir);
+    }
+    dir_entry *e = &dir[k];
+    int l = len + sprintf(path + len, "/%.*s", MAX_NAME_LENGHT, e->name);
+    int last = (i == n_entry - 1);
+    // os blocos inválidos ou já visitados são ignorados para não entrar em ciclos
+    if(pre(e, path, depth, last, arg) && e->type == TYPE_DIR &&
+       e->first_block >= 0 && e->first_block < n && !seen[e->first_block]){
+      seen[e->first_block] = 1;
+      walk_dir(e->first_block, path, l, depth + 1, seen, pre, post, arg);
+      if(post != NULL)
+        post(e, path, depth, last, arg);
+    }
+    path[len] = '\0';
+  }
+  return;
+}
+
+// percorre a árvore a partir do diretório block, com os caminhos começados por "."
+void walk_tree(int block, walk_fn pre, walk_fn post, void *arg){
+  int n = FAT_ENTRIES(sb->fat_type);
+  char *seen = calloc(n, sizeof(char));
+  char *path = malloc(n*(MAX_NAME_LENGHT + 1) + 2);
+
+  strcpy(path, ".");
+  seen[block] = 1;
+  walk_dir(block, path, 1, 0, seen, pre, post, arg);
+  out_flush();
+
+  free(seen);
+  free(path);
+  return;
+}
+
+
+// verify - verifica o CRC32C de todos os ficheiros do sistema de ficheiros
+typedef struct verify_state {
+  int n_files;
+  int n_bad;
+} verify_state;
+
+int verify_visit(dir_entry *e, char *path, int depth, int last, void *arg){
+  verify_state *st = arg;
+
+  if(e->type != TYPE_FILE)
+    return 1;
+  st->n_files ++;
+  if(!file_crc_ok(e)){
+    // os caminhos começam em "." (a raiz), que não é escrito
+    out_printf("verify: '%s' is corrupted - checksum mismatch\n", path + 1);
+    st->n_bad ++;
+  }
+  return 1;
+}
+
+void vfs_verify(void) {
+  verify_state st;
+
+  st.n_files = 0;
+  st.n_bad = 0;
+  walk_tree(sb->root_block, verify_visit, NULL, &st);
+  printf("verify: %d file(s) checked, %d corrupted\n", st.n_files, st.n_bad);
+  return;
+}
+
+
+// find padrão - escreve o caminho das entradas cujo nome corresponde ao padrão
+int find_visit(dir_entry *e, char *path, int depth, int last, void *arg){
+  char name[MAX_NAME_LENGHT + 1];
+
+  snprintf(name, sizeof(name), "%.*s", MAX_NAME_LENGHT, e->name);
+  if(fnmatch((char *) arg, name, 0) == 0)
+    out_printf("%s\n", path);
+  return 1;
+}
+
+void vfs_find(char *padrao) {
+  walk_tree(current_dir, find_visit, NULL, padrao);
+  return;
+}
+
+
+// du - escreve o espaço ocupado por cada subdiretório do diretório actual
+typedef struct du_state {
+  int *total;  // bytes ocupados em cada nível da descida
+} du_state;
+
+int du_visit(dir_entry *e, char *path, int depth, int last, void *arg){
+  du_state *st = arg;
+
+  // o espaço de um subdiretório só é somado ao do pai depois de percorrido
+  if(e->type == TYPE_DIR)
+    st->total[depth + 1] = chain_length(e->first_block)*sb->block_size;
+  else
+    st->total[depth] += chain_length(e->first_block)*sb->block_size;
+  return 1;
+}
+
+int du_leave(dir_entry *e, char *path, int depth, int last, void *arg){
+  du_state *st = arg;
+
+  out_printf("%-10d %s\n", st->total[depth + 1], path);
+  st->total[depth] += st->total[depth + 1];
+  return 1;
+}
+
+void vfs_du(void) {
+  du_state st;
+
+  st.total = calloc(FAT_ENTRIES(sb->fat_type) + 2, sizeof(int));
+  st.total[0] = chain_length(current_dir)*sb->block_size;
+  walk_tree(current_dir, du_visit, du_leave, &st);
+  printf("%-10d .\n", st.total[0]);
+
+  free(st.total);
+  return;
+}
+
+
+// tree - escreve a árvore de diretórios a partir do diretório actual
+typedef struct tree_state {
+  char *last;   // indica, para cada nível, se a entrada é a última do seu diretório
+  int n_dirs;
+  int n_files;
+} tree_state;
+
+int tree_visit(dir_entry *e, char *path, int depth, int last, void *arg){
+  tree_state *st = arg;
+  int d;
+
+  for(d = 0; d < depth; d++)
+    out_printf(st->last[d] ? "    " : "|   ");
+  out_printf("%s%.*s%s\n", last ? "`-- " : "|-- ", MAX_NAME_LENGHT, e->name, e->type == TYPE_DIR ? "/" : "");
+  st->last[depth] = last;
+  if(e->type == TYPE_DIR)
+    st->n_dirs ++;
+  else
+    st->n_files ++;
+  return 1;
+}
+
+void vfs_tree(void) {
+  tree_state st;
+
+  st.last = calloc(FAT_ENTRIES(sb->fat_type) + 1, sizeof(char));
+  st.n_dirs = 0;
+  st.n_files = 0;
+  printf(".\n");
+  walk_tree(current_dir, tree_visit, NULL, &st);
+  printf("\n%d directories, %d files\n", st.n_dirs, st.n_files);
+
+  free(st.last);
+  return;
+}
+
+
+// pack fich - guarda no ficheiro UNIX fich apenas os blocos em uso do sistema de ficheiros,
+// renumerados de forma contígua (cada cadeia fica em blocos consecutivos)
+int pack_chain(int block, int *map, int *order, int n_live){
+  chain_cursor c;
+
+  chain_start(&c, block);
+  while((block = chain_next_data(&c)) != -1){
+    map[block] = n_live;
+    order[n_live++] = block;
+  }
+  return n_live;
+}
+
+// devolve o elo link com o número novo do bloco (mantendo os buracos)
+int pack_link(int link, int *map){
+  if(IS_HOLE_LINK(link))
+    return HOLE_LINK(HOLE_COUNT(link), HOLE_NEXT(link) == -1 ? -1 : map[HOLE_NEXT(link)]);
+  return link == -1 ? -1 : map[link];
+}
+
+void vfs_pack(char *nome_dest) {
+  int n = FAT_ENTRIES(sb->fat_type);
+  int epb = DIR_ENTRIES_PER_BLOCK;
+  int i, j, k;
+
+  if(vfs_fsck(0, 0) > 0){
+    printf("ERROR(pack: filesystem has errors - run 'fsck' first)\n");
+    return;
+  }
+
+  int f = open(nome_dest, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(f == -1){
+    printf("ERROR(pack: cannot create file %s)\n", nome_dest);
+    return;
+  }
+
+  // map: número novo de cada bloco; order: bloco antigo de cada número novo;
+  // n_dir: entradas válidas de cada bloco de diretório (-1 se for um bloco de dados)
+  int *map = malloc(n*sizeof(int));
+  int *order = malloc(n*sizeof(int));
+  int *n_dir = malloc(n*sizeof(int));
+  int *stack = malloc(n*sizeof(int));
+  int n_live = 0, top = 0, ok = 1;
+  for(i = 0; i < n; i++)
+    n_dir[i] = -1;
+
+  stack[top++] = sb->root_block;
+  n_live = pack_chain(sb->root_block, map, order, n_live);
+  while(top > 0){
+    int block = stack[--top];
+    int n_entry = ((dir_entry *) BLOCK(block))[0].size;
+    for(i = 0, j = block; j != -1; i += epb, j = fat[j])
+      n_dir[j] = n_entry - i < epb ? n_entry - i : epb;
+    for(i = 2; i < n_entry; i++){
+      dir_entry *e = get_dir_entry(block, i);
+      n_live = pack_chain(e->first_block, map, order, n_live);
+      if(e->type == TYPE_DIR)
+        stack[top++] = e->first_block;
+    }
+  }
+
+  pack_header h;
+  h.magic = PACK_MAGIC;
+  h.block_size = sb->block_size;
+  h.fat_type = sb->fat_type;
+  h.n_blocks = n_live;
+  if(write(f, &h, sizeof(h)) != sizeof(h))
+    ok = 0;
+
+  // FAT dos blocos em uso, já com os números novos
+  for(i = 0; i < n_live; i++)
+    stack[i] = pack_link(fat[order[i]], map);
+  if(ok && write(f, stack, n_live*sizeof(int)) != n_live*sizeof(int))
+    ok = 0;
+
+  // blocos de dados; nos diretórios as referências a blocos são renumeradas
+  char *buf = malloc(sb->block_size);
+  dir_entry *dir = (dir_entry *) buf;
+  for(i = 0; i < n_live && ok; i++){
+    j = order[i];
+    if(n_dir[j] == -1){
+      if(write(f, BLOCK(j), sb->block_size) != sb->block_size)
+        ok = 0;
+      continue;
+    }
+    memset(buf, 0, sb->block_size);
+    memcpy(buf, BLOCK(j), n_dir[j]*sizeof(dir_entry));
+    for(k = 0; k < n_dir[j]; k++)
+      dir[k].first_block = pack_link(dir[k].first_block, map);
+    if(write(f, buf, sb->block_size) != sb->block_size)
+      ok = 0;
+  }
+  // só um ficheiro normal incompleto é apagado (nunca um dispositivo, p.ex. /dev/full)
+  struct stat f_stat;
+  int regular = fstat(f, &f_stat) == 0 && S_ISREG(f_stat.st_mode);
+  if(close(f) == -1)
+    ok = 0;
+  if(ok)
+    printf("pack: %d of %d blocks written to %s\n", n_live, n, nome_dest);
+  else {
+    printf("ERROR(pack: cannot write %s)\n", nome_dest);
+    if(regular)
+      unlink(nome_dest);
+  }
+
+  free(buf);
+  free(map);
+  free(order);
+  free(n_dir);
+  free(stack);
+  return;
+}
+
+
+// unpack fich1 fich2 - reconstrói no ficheiro UNIX fich2 o sistema de ficheiros guardado
+// (com pack) em fich1; os blocos não usados ficam na lista de blocos livres;
+// o sistema de ficheiros é escrito num ficheiro temporário que só no fim substitui fich2
+void vfs_unpack(char *nome_orig, char *nome_dest) {
+  pack_header h;
+  struct stat dest_stat;
+  int i, next;
+
+  if(stat(nome_dest, &dest_stat) == 0 && dest_stat.st_dev == fs_dev && dest_stat.st_ino == fs_ino){
+    printf("ERROR(unpack: %s is the mounted filesystem)\n", nome_dest);
+    return;
+  }
+
+  int in = open(nome_orig, O_RDONLY);
+  if(in == -1){
+    printf("ERROR(unpack: couldnt found file %s)\n", nome_orig);
+    return;
+  }
+  if(read(in, &h, sizeof(h)) != sizeof(h) || h.magic != PACK_MAGIC ||
+     (h.block_size != 128 && h.block_size != 256 && h.block_size != 512 && h.block_size != 1024) ||
+     (h.fat_type != 7 && h.fat_type != 8 && h.fat_type != 9 && h.fat_type != 10) ||
+     h.n_blocks < 1 || h.n_blocks > FAT_ENTRIES(h.fat_type)){
+    printf("ERROR(unpack: %s is not a valid pack)\n", nome_orig);
+    close(in);
+    return;
+  }
+
+  char *tmp = malloc(strlen(nome_dest) + 8);
+  sprintf(tmp, "%s.XXXXXX", nome_dest);
+  int out = mkstemp(tmp);
+  if(out == -1){
+    printf("ERROR(unpack: cannot create filesystem %s)\n", nome_dest);
+    free(tmp);
+    close(in);
+    return;
+  }
+  fchmod(out, S_IRWXU);
+
+  int n = FAT_ENTRIES(h.fat_type);
+  char *buf = calloc(h.block_size, sizeof(char));
+  superblock *s = (superblock *) buf;
+  int ok = 1, w_ok = 1;  // ok: pacote lido sem erros, w_ok: sistema de ficheiros escrito
+
+  // superblock
+  s->check_number = CHECK_NUMBER;
+  s->block_size = h.block_size;
+  s->fat_type = h.fat_type;
+  s->root_block = 0;
+  s->free_block = h.n_blocks < n ? h.n_blocks : -1;
+  s->n_free_blocks = n - h.n_blocks;
+  if(write(out, buf, h.block_size) != h.block_size)
+    w_ok = 0;
+
+  // FAT: os blocos em uso vêm do pacote, os restantes formam a lista de blocos livres
+  for(i = 0; i < n && ok && w_ok; i++){
+    if(i < h.n_blocks){
+      if(read(in, &next, sizeof(int)) != sizeof(int))
+        ok = 0;
+      else if((IS_HOLE_LINK(next) ? HOLE_NEXT(next) : next) >= h.n_blocks)
+        ok = 0;
+    } else
+      next = i + 1 < n ? i + 1 : -1;
+    if(ok && write(out, &next, sizeof(int)) != sizeof(int))
+      w_ok = 0;
+  }
+
+  // blocos em uso; o resto do sistema de ficheiros é apenas estendido
+  for(i = 0; i < h.n_blocks && ok && w_ok; i++){
+    if(read(in, buf, h.block_size) != h.block_size)
+      ok = 0;
+    else if(write(out, buf, h.block_size) != h.block_size)
+      w_ok = 0;
+  }
+  if(ok && w_ok && ftruncate(out, h.block_size + FAT_SIZE(h.fat_type) + n*h.block_size) == -1)
+    w_ok = 0;
+  close(in);
+  if(close(out) == -1)
+    w_ok = 0;
+  free(buf);
+
+  if(!ok || !w_ok){
+    if(!ok)
+      printf("ERROR(unpack: %s is truncated or corrupted)\n", nome_orig);
+    else
+      printf("ERROR(unpack: cannot write filesystem %s)\n", nome_dest);
+    unlink(tmp);
+    free(tmp);
+    return;
+  }
+  if(rename(tmp, nome_dest) == -1){
+    printf("ERROR(unpack: cannot create filesystem %s)\n", nome_dest);
+    unlink(tmp);
+    free(tmp);
+    return;
+  }
+  free(tmp);
+  printf("unpack: %d of %d blocks restored to %s\n", h.n_blocks, n, nome_dest);
+  return;
+}